@@ -3,6 +3,7 @@
 
 #include <cstdio>
 #include <math.h>
+#include <vector>
 #include "BoundingBox.h"
 
 struct GridLoc {
@@ -38,7 +39,7 @@ public:
  //           && (cellSize == testGrid->cellSize));
   }
   
-  bool GetGridLoc(float lon, float lat, GridLoc *pt) {
+  bool GetGridLoc(float lon, float lat, GridLoc *pt) const {
     float xDiff = lon - extent.left;
     float yDiff = extent.top - lat;
     float xLoc = xDiff/cellSizeX;
@@ -80,6 +81,7 @@ public:
     data = NULL;
     backingStore = NULL;
 		geoSet = false;
+    tileWidth = tileLength = tilesAcross = 0;
   }
   ~FloatGrid() {
     if (data) {
@@ -98,6 +100,13 @@ public:
   float noData;
   float **data;
   float *backingStore;
+  // Set when only some tiles were read, one flag per tile in row order; empty when every cell was read
+  std::vector<char> tilesRead;
+  long tileWidth, tileLength, tilesAcross;
+  
+  bool IsRead(const GridLoc *pt) const {
+    return tilesRead.empty() || tilesRead[(pt->y / tileLength) * tilesAcross + pt->x / tileWidth];
+  }
   
 };
 
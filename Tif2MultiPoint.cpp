@@ -3,8 +3,7 @@
 #include <stdlib.h>
 #include <vector>
 
-#include "Grid.h"
-#include "TifGrid.h"
+#include "Tif2MultiPoint.h"
 
 #define NO_DATA "No Data"
 
@@ -16,10 +15,7 @@ struct Point {
 };
 
 
-static float GetDataValue(FloatGrid *grid, double lat, double lon);
-static bool ReadPoints(char *file);
-
-std::vector<Point *> points;
+static bool ReadPoints(char *file, std::vector<Point *> &points);
 
 int main(int argc, char *argv[]) {
 
@@ -38,40 +34,31 @@ int main(int argc, char *argv[]) {
 	int numInputFiles = argc - expectedArgs;
 	int argInputFileIndex = expectedArgs;
 
-	if (!ReadPoints(argInputCSV)) {
+	std::vector<Point *> points;
+	if (!ReadPoints(argInputCSV, points)) {
 		printf("Point reading failure\n");
 		return 1;
 	}
 
-	FloatGrid *dataGrids[numInputFiles];
+	std::vector<float> lats(points.size()), lons(points.size());
+	for (size_t i = 0; i < points.size(); i++) {
+		lats[i] = points[i]->lat;
+		lons[i] = points[i]->lon;
+	}
+	T2MPPointSet *pointSet = t2mp_points_create(lats.data(), lons.data(), points.size());
+
+	std::vector<T2MPRaster *> rasters(numInputFiles);
 	bool allOutside = true;
 	bool foundTifs = false;
 	int firstIndex = -1;
 
-	double top = -90.0, bottom = 90.0, left = 180.0, right = -180.0;
-	for (size_t i = 0; i < points.size(); i++) {
-		if (points[i]->lat > top) {
-			top = points[i]->lat;
-		}
-		if (points[i]->lat < bottom) {
-                        bottom = points[i]->lat;
-                }
-		if (points[i]->lon > right) {
-                        right = points[i]->lon;
-                }
-		if (points[i]->lon < left) {
-                        left = points[i]->lon;
-                }
-	}
-
 	for (int i = 0; i < numInputFiles; i++) {
-		bool outside = false;
-  		dataGrids[i] = ReadFloatTifGrid(argv[argInputFileIndex + i], top, bottom, left, right, &outside);
-		if (dataGrids[i] && !foundTifs) {
+		int status = t2mp_raster_open(argv[argInputFileIndex + i], pointSet, &rasters[i]);
+		if (rasters[i] && !foundTifs) {
 			foundTifs = true;
 			firstIndex = i;
 		}
-		if (!dataGrids[i] && !outside) {
+		if (!rasters[i] && status != T2MP_OUTSIDE) {
 			allOutside = false;
 		}
 	}
@@ -83,26 +70,44 @@ int main(int argc, char *argv[]) {
 		printf(NO_DATA);
                 return 1;
 	}
+
+	// Sample every raster in one batch, then take the first one with data for each point
+	std::vector<std::vector<float> > values(numInputFiles);
+	for (int j = 0; j < numInputFiles; j++) {
+		if (!rasters[j]) {
+			continue;
+		}
+		values[j].resize(points.size());
+		if (t2mp_sample_points(rasters[j], pointSet, values[j].data()) != T2MP_OK) {
+			values[j].clear(); // Treat the raster as having no data rather than trust partial values
+		}
+	}
 	
+	float firstNoData = t2mp_raster_nodata(rasters[firstIndex]);
 	for (size_t i = 0; i < points.size(); i++) {
-		float data = dataGrids[firstIndex]->noData;
+		float data = firstNoData;
 		for (int j = 0; j < numInputFiles; j++) {
-			if (!dataGrids[j]) {
+			if (!rasters[j] || values[j].empty()) {
 				continue;
 			}
-			data = GetDataValue(dataGrids[j], points[i]->lat, points[i]->lon);
-			if (data != dataGrids[j]->noData) {
+			data = values[j][i];
+			if (data != t2mp_raster_nodata(rasters[j])) {
 				break; // We found some data!!
 			}
 		}
 
-		if (data == dataGrids[firstIndex]->noData) {
+		if (data == firstNoData) {
 			sprintf(points[i]->data, "%s", NO_DATA);
 		} else {
 			sprintf(points[i]->data, "%.02f", data);
 		}
 	}
 
+	for (int i = 0; i < numInputFiles; i++) {
+		t2mp_raster_close(rasters[i]);
+	}
+	t2mp_points_free(pointSet);
+
 	FILE *output = fopen(argOutput, "wb");
 	if (!strcasecmp(argFormat, "czml")) {
 		//CZML output
@@ -126,7 +131,7 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
-bool ReadPoints(char *file) {
+bool ReadPoints(char *file, std::vector<Point *> &points) {
 	FILE *pFile = fopen(file, "rb");
 	if (pFile == NULL) {
 		printf("Failed to open file %s\n", file);
@@ -144,11 +149,3 @@ bool ReadPoints(char *file) {
 	printf("Read in %lu points\n", points.size());
 	return true;
 }
-
-float GetDataValue(FloatGrid *grid, double lat, double lon) {
-	GridLoc pt;
-	if (!grid->GetGridLoc(lon, lat, &pt)) {
-		return grid->noData;
-	}
-	return grid->data[pt.y][pt.x];
-}
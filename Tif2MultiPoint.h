@@ -0,0 +1,53 @@
+#ifndef TIF2MULTIPOINT_H
+#define TIF2MULTIPOINT_H
+
+#include <stddef.h>
+
+/*
+ * C API for sampling Float32 GeoTiffs at a set of points.
+ *
+ * Rasters may be opened from several threads at once. A raster handle is
+ * read-only after it is opened, so any number of threads may call
+ * t2mp_sample() on the same handle concurrently. Point sets only describe
+ * the area a raster needs to cover; opening a raster against a point set
+ * loads just the rows that cover those points.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T2MP_OK 0
+#define T2MP_ERROR 1
+#define T2MP_OUTSIDE 2
+
+typedef struct T2MPRaster T2MPRaster;
+typedef struct T2MPPointSet T2MPPointSet;
+
+T2MPPointSet *t2mp_points_create(const float *lats, const float *lons, size_t count);
+void t2mp_points_free(T2MPPointSet *points);
+size_t t2mp_points_count(const T2MPPointSet *points);
+
+/* Opens file and loads the area covering points (the whole raster if points is NULL).
+ * Tiled rasters only read the tiles holding the points.
+ * Returns T2MP_OUTSIDE if the raster does not intersect the points. */
+int t2mp_raster_open(const char *file, const T2MPPointSet *points, T2MPRaster **raster);
+/* Like t2mp_raster_open but loads the zero-based bands from a single open (every band if bandCount is 0). */
+int t2mp_raster_open_bands(const char *file, const T2MPPointSet *points, const int *bands, size_t bandCount, T2MPRaster **raster);
+size_t t2mp_raster_band_count(const T2MPRaster *raster);
+void t2mp_raster_close(T2MPRaster *raster);
+float t2mp_raster_nodata(const T2MPRaster *raster);
+
+/* Writes one value per point of the first loaded band into the caller-owned outValues, noData for points off the raster.
+ * A point on the raster but outside the rows or tiles read at open gets NaN, and the call then returns T2MP_ERROR
+ * after filling the rest of outValues. */
+int t2mp_sample(const T2MPRaster *raster, const float *lats, const float *lons, size_t count, float *outValues);
+int t2mp_sample_points(const T2MPRaster *raster, const T2MPPointSet *points, float *outValues);
+/* Samples every loaded band, writing count values per band one band after another. */
+int t2mp_sample_bands(const T2MPRaster *raster, const float *lats, const float *lons, size_t count, float *outValues);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
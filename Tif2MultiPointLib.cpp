@@ -0,0 +1,153 @@
+#include <limits>
+#include <vector>
+#include "Tif2MultiPoint.h"
+#include "TifGrid.h"
+
+struct T2MPPointSet {
+  std::vector<float> lats;
+  std::vector<float> lons;
+  std::vector<RefLoc> locs;
+  BoundingBox extent;
+};
+
+struct T2MPRaster {
+  std::vector<FloatGrid *> grids;
+};
+
+T2MPPointSet *t2mp_points_create(const float *lats, const float *lons, size_t count) {
+  if ((!lats || !lons) && count) {
+    return NULL;
+  }
+
+  T2MPPointSet *points = new T2MPPointSet();
+  points->lats.assign(lats, lats + count);
+  points->lons.assign(lons, lons + count);
+  points->locs.resize(count);
+
+  points->extent.top = -90.0;
+  points->extent.bottom = 90.0;
+  points->extent.left = 180.0;
+  points->extent.right = -180.0;
+  for (size_t i = 0; i < count; i++) {
+    points->locs[i].x = lons[i];
+    points->locs[i].y = lats[i];
+    if (lats[i] > points->extent.top) {
+      points->extent.top = lats[i];
+    }
+    if (lats[i] < points->extent.bottom) {
+      points->extent.bottom = lats[i];
+    }
+    if (lons[i] > points->extent.right) {
+      points->extent.right = lons[i];
+    }
+    if (lons[i] < points->extent.left) {
+      points->extent.left = lons[i];
+    }
+  }
+
+  return points;
+}
+
+void t2mp_points_free(T2MPPointSet *points) {
+  delete points;
+}
+
+size_t t2mp_points_count(const T2MPPointSet *points) {
+  return points ? points->lats.size() : 0;
+}
+
+int t2mp_raster_open(const char *file, const T2MPPointSet *points, T2MPRaster **raster) {
+  int band = 0;
+  return t2mp_raster_open_bands(file, points, &band, 1, raster);
+}
+
+int t2mp_raster_open_bands(const char *file, const T2MPPointSet *points, const int *bands, size_t bandCount, T2MPRaster **raster) {
+  if (!file || !raster || (!bands && bandCount)) {
+    return T2MP_ERROR;
+  }
+  *raster = NULL;
+
+  double top, bottom, left, right;
+  if (points) {
+    top = points->extent.top;
+    bottom = points->extent.bottom;
+    left = points->extent.left;
+    right = points->extent.right;
+  } else {
+    top = right = std::numeric_limits<double>::max();
+    bottom = left = -std::numeric_limits<double>::max();
+  }
+
+  bool outside = false;
+  std::vector<int> bandList(bands, bands + bandCount);
+  std::vector<FloatGrid *> grids = ReadFloatTifBands(file, bandList, top, bottom, left, right, &outside, points ? &points->locs : NULL);
+  if (grids.empty()) {
+    return outside ? T2MP_OUTSIDE : T2MP_ERROR;
+  }
+
+  *raster = new T2MPRaster();
+  (*raster)->grids = grids;
+  return T2MP_OK;
+}
+
+void t2mp_raster_close(T2MPRaster *raster) {
+  if (raster) {
+    for (size_t b = 0; b < raster->grids.size(); b++) {
+      delete raster->grids[b];
+    }
+    delete raster;
+  }
+}
+
+size_t t2mp_raster_band_count(const T2MPRaster *raster) {
+  return raster ? raster->grids.size() : 0;
+}
+
+float t2mp_raster_nodata(const T2MPRaster *raster) {
+  return raster ? raster->grids[0]->noData : std::numeric_limits<float>::quiet_NaN();
+}
+
+static int SampleGrids(const T2MPRaster *raster, size_t numBands, const float *lats, const float *lons, size_t count, float *outValues) {
+  if (!raster || ((!lats || !lons || !outValues) && count)) {
+    return T2MP_ERROR;
+  }
+
+  // Every band shares the same geometry, rows and tiles, so each point is located once for all of them
+  const FloatGrid *geometry = raster->grids[0];
+  int status = T2MP_OK;
+  for (size_t i = 0; i < count; i++) {
+    GridLoc pt;
+    bool inGrid = geometry->GetGridLoc(lons[i], lats[i], &pt);
+    bool loaded = inGrid && geometry->data[pt.y] && geometry->IsRead(&pt);
+    if (inGrid && !loaded) {
+      status = T2MP_ERROR;
+    }
+    for (size_t b = 0; b < numBands; b++) {
+      const FloatGrid *grid = raster->grids[b];
+      if (!inGrid) {
+        outValues[b * count + i] = grid->noData;
+      } else if (!loaded) {
+        outValues[b * count + i] = std::numeric_limits<float>::quiet_NaN();
+      } else {
+        outValues[b * count + i] = grid->data[pt.y][pt.x];
+      }
+    }
+  }
+  return status;
+}
+
+int t2mp_sample(const T2MPRaster *raster, const float *lats, const float *lons, size_t count, float *outValues) {
+  return SampleGrids(raster, 1, lats, lons, count, outValues);
+}
+
+int t2mp_sample_bands(const T2MPRaster *raster, const float *lats, const float *lons, size_t count, float *outValues) {
+  return SampleGrids(raster, raster ? raster->grids.size() : 0, lats, lons, count, outValues);
+}
+
+int t2mp_sample_points(const T2MPRaster *raster, const T2MPPointSet *points, float *outValues) {
+  if (!points) {
+    return T2MP_ERROR;
+  }
+  size_t count = points->lats.size();
+  return t2mp_sample(raster, count ? &points->lats[0] : NULL, count ? &points->lons[0] : NULL, count, outValues);
+}
@@ -1,11 +1,19 @@
+#include <algorithm>
 #include <limits>
 #include <cstdio>
 #include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
 #include "xtiffio.h"
 #include "geotiffio.h"
 #include "Messages.h"
 #include "Defines.h"
 #include "TifGrid.h"
+#include "TilePrefetch.h"
 
 #define TIFFTAG_GDAL_METADATA 42112
 #define TIFFTAG_GDAL_NODATA 42113
@@ -20,18 +28,34 @@ static void TIFFExtenderInit();
 static void TIFFDefaultDirectory(TIFF *tif);
 
 
-static void TIFFExtenderInit() {
-  static int first_time=1;
-  
-  if (!first_time) {
-    return; /* Been there. Done that. */
-  }
-  first_time = 0;
-  
+static bool TIFFExtenderInstall() {
   /* Grab the inherited method and install */
   TIFFParentExtender = TIFFSetTagExtender(TIFFDefaultDirectory);
   
   TIFFSetErrorHandler(NULL);
+  return true;
+}
+
+static void TIFFExtenderInit() {
+  /* Static initialization runs once even when several threads open files at the same time */
+  static bool installed = TIFFExtenderInstall();
+  (void)installed;
+}
+
+/* libgeotiff installs its own tag extender on the first XTIFFOpen without any locking,
+ * so opens are serialized until that has happened once. XTIFFOpen initializes before
+ * opening the file, so a failed open still counts. */
+static std::mutex xtiffOpenMutex;
+static std::atomic<bool> xtiffInitialized(false);
+
+static TIFF *OpenTif(const char *file, const char *mode) {
+  if (xtiffInitialized.load()) {
+    return XTIFFOpen(file, mode);
+  }
+  std::lock_guard<std::mutex> lock(xtiffOpenMutex);
+  TIFF *tif = XTIFFOpen(file, mode);
+  xtiffInitialized.store(true);
+  return tif;
 }
 
 static void TIFFDefaultDirectory(TIFF *tif) {
@@ -48,15 +72,128 @@ static void TIFFDefaultDirectory(TIFF *tif) {
   }
 }
 
+static void DeinterleaveFloats(const float *src, int samplesPerPixel, const std::vector<int> &bands, float **dst, long count) {
+  if (samplesPerPixel == 1) {
+    // The same band may be listed more than once, and each entry gets its own copy
+    for (size_t b = 0; b < bands.size(); b++) {
+      memcpy(dst[b], src, count * sizeof(float));
+    }
+    return;
+  }
+  
+  long i = 0;
+#ifdef __SSE2__
+  if (samplesPerPixel == 2) {
+    for (; i + 4 <= count; i += 4) {
+      __m128 lo = _mm_loadu_ps(src + i * 2);
+      __m128 hi = _mm_loadu_ps(src + i * 2 + 4);
+      __m128 split[2] = { _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)) };
+      for (size_t b = 0; b < bands.size(); b++) {
+        _mm_storeu_ps(dst[b] + i, split[bands[b]]);
+      }
+    }
+  } else if (samplesPerPixel == 4) {
+    for (; i + 4 <= count; i += 4) {
+      __m128 split[4] = { _mm_loadu_ps(src + i * 4), _mm_loadu_ps(src + i * 4 + 4),
+                          _mm_loadu_ps(src + i * 4 + 8), _mm_loadu_ps(src + i * 4 + 12) };
+      _MM_TRANSPOSE4_PS(split[0], split[1], split[2], split[3]);
+      for (size_t b = 0; b < bands.size(); b++) {
+        _mm_storeu_ps(dst[b] + i, split[bands[b]]);
+      }
+    }
+  } else if (samplesPerPixel >= 3) {
+    // Samples are taken in groups of four, and each group of four pixels is transposed like the
+    // four sample case. A group can run into the next pixel, so the last pixel is left to the scalar
+    // loop. Bands are sorted by group so each transposed group only visits the bands it holds.
+    int groups = (samplesPerPixel + 3) / 4;
+    std::vector<size_t> groupStart(groups + 1, 0);
+    for (size_t b = 0; b < bands.size(); b++) {
+      groupStart[bands[b] / 4 + 1]++;
+    }
+    for (int g = 0; g < groups; g++) {
+      groupStart[g + 1] += groupStart[g];
+    }
+    std::vector<size_t> fill(groupStart.begin(), groupStart.end() - 1);
+    std::vector<float *> groupDst(bands.size());
+    std::vector<int> groupLane(bands.size());
+    for (size_t b = 0; b < bands.size(); b++) {
+      size_t slot = fill[bands[b] / 4]++;
+      groupDst[slot] = dst[b];
+      groupLane[slot] = bands[b] % 4;
+    }
+    for (; i + 4 < count; i += 4) {
+      for (int g = 0; g < groups; g++) {
+        if (groupStart[g] == groupStart[g + 1]) {
+          continue;
+        }
+        const float *block = src + i * samplesPerPixel + g * 4;
+        __m128 split[4] = { _mm_loadu_ps(block), _mm_loadu_ps(block + samplesPerPixel),
+                            _mm_loadu_ps(block + samplesPerPixel * 2), _mm_loadu_ps(block + samplesPerPixel * 3) };
+        _MM_TRANSPOSE4_PS(split[0], split[1], split[2], split[3]);
+        for (size_t k = groupStart[g]; k < groupStart[g + 1]; k++) {
+          _mm_storeu_ps(groupDst[k] + i, split[groupLane[k]]);
+        }
+      }
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    const float *pixel = src + i * samplesPerPixel;
+    for (size_t b = 0; b < bands.size(); b++) {
+      dst[b][i] = pixel[bands[b]];
+    }
+  }
+}
+
+static FloatGrid *AllocFloatGrid(const char *file, int width, int height, const BoundingBox &gridBB, const BoundingBox &tileBB, double *pixscale) {
+  FloatGrid *grid = new FloatGrid();
+  grid->numCols = width;
+  grid->numRows = height;
+  grid->data = new float*[grid->numRows]();
+  if (!grid->data) {
+    WARNING_LOGF("TIF file %s too large (out of memory) with %li rows", file, grid->numRows);
+    delete grid;
+    return NULL;
+  }
+  for (long i = 0; i < grid->numRows; i++) {
+    double rowLat = gridBB.top - (float)(i) * pixscale[1];
+    if (rowLat >= (tileBB.bottom - pixscale[1]) && rowLat <= (tileBB.top + pixscale[1])) {
+      grid->data[i] = new float[grid->numCols]();
+      if (!grid->data[i]) {
+        WARNING_LOGF("TIF file %s too large (out of memory) with %li columns", file, grid->numCols);
+        delete grid;
+        return NULL;
+      }
+    }
+  }
+  return grid;
+}
+
 FloatGrid *ReadFloatTifGrid(const char *file, double top, double bottom, double left, double right, bool *outside) {
   return ReadFloatTifGrid(file, NULL, top, bottom, left, right, outside);
 }
 
 FloatGrid *ReadFloatTifGrid(const char *file, FloatGrid *incGrid, double top, double bottom, double left, double right, bool *outside) {
+  std::vector<int> bands(1, 0);
+  std::vector<FloatGrid *> grids(1, incGrid);
+  if (!ReadFloatTifBands(file, bands, grids, top, bottom, left, right, outside)) {
+    return NULL;
+  }
+  return grids[0];
+}
+
+std::vector<FloatGrid *> ReadFloatTifBands(const char *file, const std::vector<int> &bands, double top, double bottom, double left, double right, bool *outside, const std::vector<RefLoc> *points) {
+  std::vector<FloatGrid *> grids;
+  if (!ReadFloatTifBands(file, bands, grids, top, bottom, left, right, outside, points)) {
+    grids.clear();
+  }
+  return grids;
+}
+
+bool ReadFloatTifBands(const char *file, const std::vector<int> &bandList, std::vector<FloatGrid *> &grids, double top, double bottom, double left, double right, bool *outside, const std::vector<RefLoc> *points) {
   
   TIFFExtenderInit();
   
-  FloatGrid *grid = incGrid;
   TIFF *tif = NULL;
   GTIF *gtif = NULL;
  
@@ -64,28 +201,46 @@ FloatGrid *ReadFloatTifGrid(const char *file, FloatGrid *incGrid, double top, do
     *outside = false;
   }
  
-  tif = XTIFFOpen(file, "r");
+  tif = OpenTif(file, "r");
   if (!tif) {
-    return NULL;
+    return false;
   }
   
   gtif = GTIFNew(tif);
   if (!gtif) {
     XTIFFClose(tif);
-    return NULL;
+    return false;
   }
   
-  unsigned short sampleFormat, samplesPerPixel, bitsPerSample;
+  unsigned short sampleFormat, samplesPerPixel, bitsPerSample, planarConfig = PLANARCONFIG_CONTIG;
   TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
   TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
   TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+  TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarConfig);
   
-  if (sampleFormat != SAMPLEFORMAT_IEEEFP || bitsPerSample != 32 || samplesPerPixel != 1) {
+  if (sampleFormat != SAMPLEFORMAT_IEEEFP || bitsPerSample != 32 || samplesPerPixel < 1) {
     WARNING_LOGF("%s is not a supported Float32 GeoTiff", file);
     GTIFFree(gtif);
     XTIFFClose(tif);
-    return NULL;
+    return false;
+  }
+  
+  // An empty band list selects every band in the file
+  std::vector<int> bands = bandList;
+  if (bands.empty()) {
+    for (int b = 0; b < samplesPerPixel; b++) {
+      bands.push_back(b);
+    }
+  }
+  for (size_t b = 0; b < bands.size(); b++) {
+    if (bands[b] < 0 || bands[b] >= samplesPerPixel) {
+      WARNING_LOGF("%s has no band %i", file, bands[b]);
+      GTIFFree(gtif);
+      XTIFFClose(tif);
+      return false;
+    }
   }
+  bool separate = (planarConfig == PLANARCONFIG_SEPARATE && samplesPerPixel > 1);
   
   int width, height;
   TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
@@ -119,109 +274,192 @@ FloatGrid *ReadFloatTifGrid(const char *file, FloatGrid *incGrid, double top, do
         }
  	GTIFFree(gtif);
 	XTIFFClose(tif);
-	return NULL;
+	return false;
    }
  
-  if (!grid || grid->numCols != width || grid->numRows != height) {
-    if (grid) {
-      delete grid;
-    }
-    grid = new FloatGrid();
-    grid->numCols = width;
-    grid->numRows = height;
-    grid->data = new float*[grid->numRows]();
-    if (!grid->data) {
-      WARNING_LOGF("TIF file %s too large (out of memory) with %li rows", file, grid->numRows);
-      delete grid;
-      GTIFFree(gtif);
-      XTIFFClose(tif);
-      return NULL;
-    }
-    for (long i = 0; i < grid->numRows; i++) {
-      double rowLat = gridBB.top - (float)(i) * pixscale[1];
-	if (rowLat >= (tileBB.bottom - pixscale[1]) && rowLat <= (tileBB.top + pixscale[1])) {
-      grid->data[i] = new float[grid->numCols]();
-      if (!grid->data[i]) {
-        WARNING_LOGF("TIF file %s too large (out of memory) with %li columns", file, grid->numCols);
+  grids.resize(bands.size(), NULL);
+  for (size_t b = 0; b < bands.size(); b++) {
+    FloatGrid *grid = grids[b];
+    if (!grid || grid->numCols != width || grid->numRows != height) {
+      if (grid) {
         delete grid;
+      }
+      grids[b] = grid = AllocFloatGrid(file, width, height, gridBB, tileBB, pixscale);
+      if (!grid) {
+        for (size_t k = 0; k < bands.size(); k++) {
+          delete grids[k];
+        }
+        grids.clear();
         GTIFFree(gtif);
         XTIFFClose(tif);
-        return NULL;
+        return false;
       }
-}
     }
-  }
   
-  char *noData = NULL;
-  if (TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &noData)) {
-    grid->noData = atof(noData);
-  } else {
-    grid->noData = std::numeric_limits<float>::quiet_NaN();
-  }
-  grid->cellSize = pixscale[0];
-  grid->cellSizeX = grid->cellSize;
-  grid->cellSizeY = pixscale[1];
-  grid->extent.top = gridBB.top;
-  grid->extent.left = gridBB.left;
-  grid->extent.bottom = gridBB.bottom;
-  grid->extent.right = gridBB.right;
+    char *noData = NULL;
+    if (TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &noData)) {
+      grid->noData = atof(noData);
+    } else {
+      grid->noData = std::numeric_limits<float>::quiet_NaN();
+    }
+    grid->cellSize = pixscale[0];
+    grid->cellSizeX = grid->cellSize;
+    grid->cellSizeY = pixscale[1];
+    grid->extent.top = gridBB.top;
+    grid->extent.left = gridBB.left;
+    grid->extent.bottom = gridBB.bottom;
+    grid->extent.right = gridBB.right;
  
-	GTIFKeyGet(gtif, GTModelTypeGeoKey, &grid->modelType, 0, 1);
-  GTIFKeyGet(gtif, GeographicTypeGeoKey, &grid->geographicType, 0, 1);
-  GTIFKeyGet(gtif, GeogGeodeticDatumGeoKey, &grid->geodeticDatum, 0, 1);
-	grid->geoSet = true;
+    GTIFKeyGet(gtif, GTModelTypeGeoKey, &grid->modelType, 0, 1);
+    GTIFKeyGet(gtif, GeographicTypeGeoKey, &grid->geographicType, 0, 1);
+    GTIFKeyGet(gtif, GeogGeodeticDatumGeoKey, &grid->geodeticDatum, 0, 1);
+    grid->geoSet = true;
+    grid->tilesRead.clear();
+  }
 
-  if (!TIFFIsTiled(tif)) { 
+  std::vector<float *> bandRows(bands.size());
+  if (!TIFFIsTiled(tif) && (samplesPerPixel == 1 || separate)) {
+  // Each planar-separate band has its own strips, so only the selected ones are decoded
+  for (size_t b = 0; b < bands.size(); b++) {
+  FloatGrid *grid = grids[b];
   for (long i = 0; i < grid->numRows; i++) {
 	if (!grid->data[i]) {
 		continue;
 	}
-    if (TIFFReadScanline(tif, grid->data[i], (unsigned int)i, 1) == -1) {
-      /*WARNING_LOGF("TIF file %s corrupt? (scanline read failed)", file);
-      delete grid;
-      GTIFFree(gtif);
-      XTIFFClose(tif);
-      return NULL;*/
+    if (TIFFReadScanline(tif, grid->data[i], (unsigned int)i, separate ? bands[b] : 0) == -1) {
       for (long j = 0; j < grid->numCols; j++) {
         grid->data[i][j] = grid->noData;
       }
     }
   }
+  }
+  } else if (!TIFFIsTiled(tif)) {
+        float *rowBuf = new float[TIFFScanlineSize(tif) / 4];
+        for (long i = 0; i < height; i++) {
+                bool haveRows = true;
+                for (size_t b = 0; b < bands.size() && haveRows; b++) {
+                        bandRows[b] = grids[b]->data[i];
+                        haveRows = (bandRows[b] != NULL);
+                }
+                if (!haveRows) {
+                        continue;
+                }
+                if (TIFFReadScanline(tif, rowBuf, (unsigned int)i, 0) == -1) {
+                        for (size_t b = 0; b < bands.size(); b++) {
+                                for (long j = 0; j < width; j++) {
+                                        bandRows[b][j] = grids[b]->noData;
+                                }
+                        }
+                        continue;
+                }
+                DeinterleaveFloats(rowBuf, samplesPerPixel, bands, &bandRows[0], width);
+        }
+        delete [] rowBuf;
   } else {
         int tileSizeFloats = TIFFTileSize(tif) / 4;
         unsigned int tileWidth, tileLength;
         TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tileWidth);
         TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileLength);
         float *tileBuf = new float[tileSizeFloats];
-        for (unsigned int y = 0; y < height; y += tileLength) {
-                for (unsigned int x = 0; x < width; x += tileWidth) {
-                        BoundingBox box;
-                        box.top = gridBB.top - (float)(y) * pixscale[1];
-                        box.bottom = gridBB.top - (float)(y + tileLength) * pixscale[1];
-                        box.left = gridBB.left + (float)(x) * pixscale[0];
-                        box.right = gridBB.left + (float)(x + tileWidth) * pixscale[0];
-                        if (box.Intersects(&tileBB)) {
-                                TIFFReadTile(tif, tileBuf, x, y, 0, 0);
-                                for (unsigned int j = 0; j < tileLength; j++) {
-                                        for (unsigned int i = 0; i < tileWidth; i++) {
-                                                unsigned int gy = y + j, gx = x + i;
-                                                if (gy >= height || gx >= width || !grid->data[gy]) {
-                                                        continue;
-                                                }
-                                                unsigned int tileIndex = j * tileLength + i;
-                                                grid->data[gy][gx] = tileBuf[tileIndex];
-                                        }
+        // Planar-separate tiles hold one band each, interleaved tiles hold every band
+        int tileSamples = separate ? 1 : samplesPerPixel;
+        std::vector<int> tileBands = separate ? std::vector<int>(1, 0) : bands;
+        size_t passes = separate ? bands.size() : 1;
+        unsigned int tilesAcross = ((unsigned int)width + tileWidth - 1) / tileWidth;
+        unsigned int tilesDown = ((unsigned int)height + tileLength - 1) / tileLength;
+
+        // With points only the tiles that hold one are read, and each grid records which those were
+        std::vector<char> wanted((size_t)tilesAcross * tilesDown, points == NULL);
+        if (points) {
+                for (size_t p = 0; p < points->size(); p++) {
+                        GridLoc loc;
+                        if (grids[0]->GetGridLoc((*points)[p].x, (*points)[p].y, &loc)) {
+                                wanted[(loc.y / tileLength) * tilesAcross + loc.x / tileWidth] = 1;
+                        }
+                }
+                for (size_t b = 0; b < bands.size(); b++) {
+                        for (long i = 0; i < grids[b]->numRows; i++) {
+                                if (grids[b]->data[i]) {
+                                        std::fill(grids[b]->data[i], grids[b]->data[i] + grids[b]->numCols, grids[b]->noData);
+                                }
+                        }
+                        grids[b]->tilesRead = wanted;
+                        grids[b]->tileWidth = tileWidth;
+                        grids[b]->tileLength = tileLength;
+                        grids[b]->tilesAcross = tilesAcross;
+                }
+        }
+
+        struct TileOrigin {
+                unsigned int x, y;
+                size_t pass;
+        };
+        std::vector<unsigned int> tiles;
+        std::vector<TileOrigin> origins;
+        for (unsigned int y = 0; y < (unsigned int)height; y += tileLength) {
+                for (unsigned int x = 0; x < (unsigned int)width; x += tileWidth) {
+                        if (!wanted[(y / tileLength) * tilesAcross + x / tileWidth]) {
+                                continue;
+                        }
+                        // Points already pick their tiles. The strict overlap test would drop a tile whose
+                        // edge a lone point sits on, because that point's bounding box has no width.
+                        if (!points) {
+                                BoundingBox box;
+                                box.top = gridBB.top - (float)(y) * pixscale[1];
+                                box.bottom = gridBB.top - (float)(y + tileLength) * pixscale[1];
+                                box.left = gridBB.left + (float)(x) * pixscale[0];
+                                box.right = gridBB.left + (float)(x + tileWidth) * pixscale[0];
+                                if (!box.Intersects(&tileBB)) {
+                                        continue;
                                 }
+                        }
+                        for (size_t pass = 0; pass < passes; pass++) {
+                                TileOrigin origin = { x, y, pass };
+                                tiles.push_back(TIFFComputeTile(tif, x, y, 0, separate ? bands[pass] : 0));
+                                origins.push_back(origin);
+                        }
+                }
+        }
 
+        // Tile bytes are fetched in the background while earlier tiles are decoded
+        TilePrefetcher prefetcher(tif, tiles);
+        long request;
+        bool decoded;
+        while ((request = prefetcher.Next(tileBuf, (tmsize_t)tileSizeFloats * 4, &decoded)) >= 0) {
+                const TileOrigin &origin = origins[request];
+                unsigned int x = origin.x, y = origin.y;
+                size_t pass = origin.pass;
+                long cols = ((unsigned int)width - x < tileWidth) ? (unsigned int)width - x : tileWidth;
+                for (unsigned int j = 0; j < tileLength; j++) {
+                        unsigned int gy = y + j;
+                        if (gy >= (unsigned int)height) {
+                                break;
                         }
+                        bool haveRows = true;
+                        for (size_t b = 0; b < tileBands.size() && haveRows; b++) {
+                                float *row = grids[separate ? pass : b]->data[gy];
+                                haveRows = (row != NULL);
+                                bandRows[b] = row + x;
+                        }
+                        if (!haveRows) {
+                                continue;
+                        }
+                        if (!decoded) {
+                                for (size_t b = 0; b < tileBands.size(); b++) {
+                                        std::fill(bandRows[b], bandRows[b] + cols, grids[separate ? pass : b]->noData);
+                                }
+                                continue;
+                        }
+                        DeinterleaveFloats(tileBuf + (long)j * tileWidth * tileSamples, tileSamples, tileBands, &bandRows[0], cols);
                 }
         }
+        delete [] tileBuf;
   }
   
   GTIFFree(gtif);
   XTIFFClose(tif);
   
-  return grid;
+  return true;
   
 }
 
@@ -232,7 +470,7 @@ void WriteFloatTifGrid(const char *file, FloatGrid *grid, const char *artist, co
   TIFF *tif = NULL;
   GTIF *gtif = NULL;
   
-  tif = XTIFFOpen(file, "w");
+  tif = OpenTif(file, "w");
   if (!tif) {
     return;
   }
@@ -317,9 +555,9 @@ LongGrid *ReadLongTifGrid(const char *file) {
   TIFF *tif = NULL;
   GTIF *gtif = NULL;
   
-  TIFFSetErrorHandler(NULL);
+  TIFFExtenderInit();
   
-  tif = XTIFFOpen(file, "r");
+  tif = OpenTif(file, "r");
   if (!tif) {
     return NULL;
   }
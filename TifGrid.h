@@ -1,10 +1,16 @@
 #ifndef TIF_GRID_H
 #define TIF_GRID_H
 
+#include <vector>
 #include "Grid.h"
 
 FloatGrid *ReadFloatTifGrid(const char *file, double top, double bottom, double left, double right, bool *outside = NULL);
 FloatGrid *ReadFloatTifGrid(const char *file, FloatGrid *incGrid, double top, double bottom, double left, double right, bool *outside = NULL);
+// Reads the zero-based bands (every band if empty) from one open of file, one grid per band.
+// Grids already in grids with matching dimensions are reused. For tiled files, points
+// (x = lon, y = lat) limits reading to the tiles holding them; the rest of the area is noData.
+std::vector<FloatGrid *> ReadFloatTifBands(const char *file, const std::vector<int> &bands, double top, double bottom, double left, double right, bool *outside = NULL, const std::vector<RefLoc> *points = NULL);
+bool ReadFloatTifBands(const char *file, const std::vector<int> &bands, std::vector<FloatGrid *> &grids, double top, double bottom, double left, double right, bool *outside = NULL, const std::vector<RefLoc> *points = NULL);
 void WriteFloatTifGrid(const char *file, FloatGrid *grid, const char *artist = NULL, const char *datetime = NULL, const char *copyright = NULL);
 LongGrid *ReadLongTifGrid(const char *file);
 
@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "TilePrefetch.h"
+
+// Tiles closer together than this are fetched with one read, gap included
+#define PREFETCH_MAX_GAP (64 * 1024)
+#define PREFETCH_MAX_RUN (8 * 1024 * 1024)
+// Bytes all prefetchers together may have read but not yet decoded
+#define PREFETCH_MAX_BYTES (64 * 1024 * 1024)
+// Reader threads shared by every prefetcher in the process
+#define PREFETCH_THREADS 4
+
+static bool TileOffsetLess(const std::pair<toff_t, size_t> &a, const std::pair<toff_t, size_t> &b) {
+  return a.first < b.first;
+}
+
+static bool ReadFully(int fd, unsigned char *buf, toff_t length, toff_t offset) {
+  while (length > 0) {
+    ssize_t got = pread(fd, buf, length, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    buf += got;
+    offset += got;
+    length -= got;
+  }
+  return true;
+}
+
+class PrefetchPool {
+
+public:
+  // Returns NULL if no reader thread could be started
+  static PrefetchPool *Get();
+
+  // The pool's mutex guards its own state and the run state of every registered prefetcher
+  std::mutex mutex;
+
+  void Register(TilePrefetcher *prefetcher);
+  void Unregister(TilePrefetcher *prefetcher, std::unique_lock<std::mutex> &lock);
+  void Release(TilePrefetcher *prefetcher, toff_t bytes);
+
+private:
+  struct Job {
+    TilePrefetcher *prefetcher;
+    size_t run;
+  };
+
+  PrefetchPool();
+  void Worker();
+  void QueueRuns(TilePrefetcher *prefetcher);
+  void QueueAll();
+
+  std::condition_variable cond;
+  std::deque<Job> jobs;
+  std::vector<TilePrefetcher *> prefetchers;
+  toff_t chargedBytes;
+  std::vector<std::thread> workers;
+
+};
+
+PrefetchPool *PrefetchPool::Get() {
+  // Never destroyed, so the reader threads stay valid until the process exits
+  static PrefetchPool *pool = new PrefetchPool();
+  return pool->workers.empty() ? NULL : pool;
+}
+
+PrefetchPool::PrefetchPool() {
+  chargedBytes = 0;
+  try {
+    for (size_t i = 0; i < PREFETCH_THREADS; i++) {
+      workers.push_back(std::thread(&PrefetchPool::Worker, this));
+    }
+  } catch (const std::exception &) {
+    // Run with the threads that did start; with none, prefetchers read through libtiff
+  }
+}
+
+void PrefetchPool::Register(TilePrefetcher *prefetcher) {
+  prefetchers.push_back(prefetcher);
+  QueueRuns(prefetcher);
+}
+
+void PrefetchPool::Unregister(TilePrefetcher *prefetcher, std::unique_lock<std::mutex> &lock) {
+  prefetchers.erase(std::find(prefetchers.begin(), prefetchers.end(), prefetcher));
+  for (std::deque<Job>::iterator it = jobs.begin(); it != jobs.end();) {
+    if (it->prefetcher == prefetcher) {
+      it = jobs.erase(it);
+      prefetcher->readsInFlight--;
+    } else {
+      ++it;
+    }
+  }
+  while (prefetcher->readsInFlight > 0) {
+    prefetcher->cond.wait(lock);
+  }
+  chargedBytes -= prefetcher->chargedBytes;
+  prefetcher->chargedBytes = 0;
+  QueueAll();
+}
+
+void PrefetchPool::Release(TilePrefetcher *prefetcher, toff_t bytes) {
+  chargedBytes -= bytes;
+  prefetcher->chargedBytes -= bytes;
+  QueueAll();
+}
+
+void PrefetchPool::QueueRuns(TilePrefetcher *prefetcher) {
+  while (prefetcher->nextRun < prefetcher->runs.size()) {
+    TilePrefetcher::Run &run = prefetcher->runs[prefetcher->nextRun];
+    if (!run.done) {
+      // The run a decoder needs next is always queued, so no prefetcher waits on the others
+      bool needed = (prefetcher->nextRun == prefetcher->consumedRuns);
+      if (!needed && chargedBytes + run.length > PREFETCH_MAX_BYTES) {
+        return;
+      }
+      chargedBytes += run.length;
+      prefetcher->chargedBytes += run.length;
+      Job job = { prefetcher, prefetcher->nextRun };
+      jobs.push_back(job);
+      prefetcher->readsInFlight++;
+      cond.notify_one();
+    }
+    prefetcher->nextRun++;
+  }
+}
+
+void PrefetchPool::QueueAll() {
+  for (size_t i = 0; i < prefetchers.size(); i++) {
+    QueueRuns(prefetchers[i]);
+  }
+}
+
+void PrefetchPool::Worker() {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (jobs.empty()) {
+        cond.wait(lock);
+      }
+      job = jobs.front();
+      jobs.pop_front();
+    }
+
+    // Offsets and lengths never change once the prefetcher is built, so they are read unlocked
+    TilePrefetcher::Run &run = job.prefetcher->runs[job.run];
+    std::vector<unsigned char> data;
+    bool ok = false;
+    try {
+      data.resize(run.length);
+      ok = data.empty() || ReadFully(job.prefetcher->fd, &data[0], run.length, run.offset);
+    } catch (const std::exception &) {
+      // The tile falls back to libtiff, which checks the byte count itself
+      ok = false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    run.data.swap(data);
+    run.ok = ok;
+    run.done = true;
+    job.prefetcher->readsInFlight--;
+    // Notified under the lock: once readsInFlight is zero the prefetcher may be destroyed
+    job.prefetcher->cond.notify_all();
+  }
+}
+
+TilePrefetcher::TilePrefetcher(TIFF *tif, const std::vector<unsigned int> &tiles) : tif(tif), requests(tiles) {
+  fd = TIFFFileno(tif);
+  active = false;
+  nextTile = 0;
+  nextRun = 0;
+  consumedRuns = 0;
+  readsInFlight = 0;
+  chargedBytes = 0;
+  pool = NULL;
+
+  toff_t *offsets = NULL;
+  toff_t *byteCounts = NULL;
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets) || !TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &byteCounts)
+      || !offsets || !byteCounts) {
+    return;
+  }
+  toff_t fileSize = (toff_t)st.st_size;
+
+  // Decode in file order so the reads below stay sequential
+  std::vector<std::pair<toff_t, size_t> > order;
+  for (size_t i = 0; i < requests.size(); i++) {
+    order.push_back(std::make_pair(offsets[requests[i]], i));
+  }
+  std::stable_sort(order.begin(), order.end(), TileOffsetLess);
+
+  for (size_t i = 0; i < order.size(); i++) {
+    Tile tile;
+    tile.request = order[i].second;
+    tile.id = requests[tile.request];
+    tile.offset = offsets[tile.id];
+    tile.length = byteCounts[tile.id];
+
+    // A tile that claims bytes past the end of the file is left for libtiff to reject
+    bool inFile = (tile.offset <= fileSize && tile.length <= fileSize - tile.offset);
+    Run *last = runs.empty() ? NULL : &runs.back();
+    if (!inFile) {
+      Run run;
+      run.offset = tile.offset;
+      run.length = 0;
+      run.done = true;
+      run.ok = false;
+      runs.push_back(run);
+    } else if (last && !last->done && tile.offset >= last->offset && tile.offset <= last->offset + last->length + PREFETCH_MAX_GAP
+        && tile.offset + tile.length - last->offset <= PREFETCH_MAX_RUN) {
+      last->length = std::max(last->length, tile.offset + tile.length - last->offset);
+    } else {
+      Run run;
+      run.offset = tile.offset;
+      run.length = tile.length;
+      run.done = false;
+      run.ok = false;
+      runs.push_back(run);
+    }
+    tile.run = runs.size() - 1;
+    this->tiles.push_back(tile);
+  }
+  active = true;
+
+  pool = PrefetchPool::Get();
+  if (!pool) {
+    // Without reader threads every tile is read through libtiff in list order
+    active = false;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pool->mutex);
+  pool->Register(this);
+}
+
+TilePrefetcher::~TilePrefetcher() {
+  if (active) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->Unregister(this, lock);
+  }
+}
+
+long TilePrefetcher::Next(void *buf, tmsize_t size, bool *decoded) {
+  if (!active) {
+    if (nextTile >= requests.size()) {
+      return -1;
+    }
+    size_t i = nextTile++;
+    *decoded = (TIFFReadEncodedTile(tif, requests[i], buf, size) != -1);
+    return (long)i;
+  }
+
+  if (nextTile >= tiles.size()) {
+    return -1;
+  }
+  const Tile &tile = tiles[nextTile++];
+  Run &run = runs[tile.run];
+  {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while (!run.done) {
+      cond.wait(lock);
+    }
+  }
+
+  if (run.ok && tile.length > 0) {
+    *decoded = TIFFReadFromUserBuffer(tif, tile.id, &run.data[tile.offset - run.offset], tile.length, buf, size);
+  } else {
+    // A failed read is retried through libtiff so only a genuinely bad tile comes back undecoded
+    *decoded = (TIFFReadEncodedTile(tif, tile.id, buf, size) != -1);
+  }
+
+  if (nextTile >= tiles.size() || tiles[nextTile].run != tile.run) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    std::vector<unsigned char>().swap(run.data);
+    consumedRuns++;
+    pool->Release(this, run.length);
+  }
+  return (long)tile.request;
+}
@@ -0,0 +1,62 @@
+#ifndef TILE_PREFETCH_H
+#define TILE_PREFETCH_H
+
+#include <vector>
+#include <condition_variable>
+#include "xtiffio.h"
+
+class PrefetchPool;
+
+// Reads the raw bytes of a set of tiles on background threads, merging tiles that sit
+// close together in the file into single reads, and hands them to libtiff for decoding
+// in file order. Every prefetcher in the process shares one pool of reader threads and
+// one budget for bytes read but not yet decoded. Falls back to TIFFReadEncodedTile when
+// the tile offsets or the reader threads are unavailable.
+class TilePrefetcher {
+
+  friend class PrefetchPool;
+
+public:
+  TilePrefetcher(TIFF *tif, const std::vector<unsigned int> &tiles);
+  ~TilePrefetcher();
+
+  // Decodes the next tile into buf and returns its index in the list given to the
+  // constructor, or -1 once every tile has been returned. decoded is false if the
+  // tile could not be read.
+  long Next(void *buf, tmsize_t size, bool *decoded);
+
+private:
+  struct Run {
+    toff_t offset;
+    toff_t length;
+    std::vector<unsigned char> data;
+    bool done;
+    bool ok;
+  };
+
+  struct Tile {
+    size_t request;
+    unsigned int id;
+    toff_t offset;
+    toff_t length;
+    size_t run;
+  };
+
+  TIFF *tif;
+  int fd;
+  bool active;
+  PrefetchPool *pool;
+  std::vector<unsigned int> requests;
+  std::vector<Tile> tiles;
+  std::vector<Run> runs;
+  size_t nextTile;
+  // Runs before nextRun have been queued, runs before consumedRuns have been decoded
+  size_t nextRun;
+  size_t consumedRuns;
+  size_t readsInFlight;
+  toff_t chargedBytes;
+  std::condition_variable cond;
+
+};
+
+#endif
@@ -1,3 +1,4 @@
 #!/bin/bash
 
-g++ -g -O3 -L/usr/lib/x86_64-linux-gnu/ -I/usr/include/geotiff Tif2MultiPoint.cpp TifGrid.cpp BoundingBox.cpp -o tif2multipoint -ltiff -lgeotiff -lz
+g++ -g -O3 -pthread -fPIC -shared -L/usr/lib/x86_64-linux-gnu/ -I/usr/include/geotiff Tif2MultiPointLib.cpp TifGrid.cpp TilePrefetch.cpp BoundingBox.cpp -o libtif2multipoint.so -ltiff -lgeotiff -lz
+g++ -g -O3 -pthread -L/usr/lib/x86_64-linux-gnu/ -I/usr/include/geotiff Tif2MultiPoint.cpp Tif2MultiPointLib.cpp TifGrid.cpp TilePrefetch.cpp BoundingBox.cpp -o tif2multipoint -ltiff -lgeotiff -lz